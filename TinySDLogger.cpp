@@ -17,6 +17,36 @@
 #define DESELECT() digitalWrite(TINY_SD_LOGGER_CS_PIN, HIGH)
 #define SELECTING !digitalRead(TINY_SD_LOGGER_CS_PIN)
 
+#ifdef TINY_SD_LOGGER_CRC
+/* Shift one bit (bit 7 of b) into CRC16-CCITT (x^16 + x^12 + x^5 + 1) */
+#define UPDATE_CRC16(b) crc16 = (crc16 << 1) ^ ((((unsigned char)(crc16 >> 8) ^ (b)) & 0x80) ? 0x1021 : 0)
+
+void TinySDLog::sendSPI(unsigned char d) 
+{
+  for (unsigned char i = 0; i < 8; i++, d <<= 1)
+  {
+    digitalWrite(TINY_SD_LOGGER_MOSI_PIN, (d & 0x80) ? HIGH : LOW);
+    digitalWrite(TINY_SD_LOGGER_SCK_PIN, HIGH);
+    UPDATE_CRC16(d);
+    digitalWrite(TINY_SD_LOGGER_SCK_PIN, LOW);
+  }
+}
+
+unsigned char TinySDLog::receiveSPI(void) 
+{
+  unsigned char d = 0;
+  digitalWrite(TINY_SD_LOGGER_MOSI_PIN, HIGH);
+  for (unsigned char i = 0; i < 8; i++)
+  {
+    digitalWrite(TINY_SD_LOGGER_SCK_PIN, HIGH);
+    d <<= 1;
+    if (digitalRead(TINY_SD_LOGGER_MISO_PIN)) d |= 0x01;
+    UPDATE_CRC16(d << 7);
+    digitalWrite(TINY_SD_LOGGER_SCK_PIN, LOW);
+  }
+  return d;
+}
+#else
 void TinySDLog::sendSPI(unsigned char d) 
 {
   shiftOut(TINY_SD_LOGGER_MOSI_PIN, TINY_SD_LOGGER_SCK_PIN, MSBFIRST, d);
@@ -27,6 +57,7 @@ unsigned char TinySDLog::receiveSPI(void)
   digitalWrite(TINY_SD_LOGGER_MOSI_PIN, HIGH);
   return shiftIn(TINY_SD_LOGGER_MISO_PIN, TINY_SD_LOGGER_SCK_PIN, MSBFIRST);
 }
+#endif
 
 void TinySDLog::initSPI(void) 
 {
@@ -53,6 +84,7 @@ void TinySDLog::initSPI(void)
 #define CMD24  (0x40+24) /* WRITE_BLOCK */
 #define CMD55  (0x40+55) /* APP_CMD */
 #define CMD58  (0x40+58) /* READ_OCR */
+#define CMD59  (0x40+59) /* CRC_ON_OFF */
 
 #define STA_NOINIT    0x01  /* Drive not initialized */
 
@@ -63,11 +95,49 @@ void TinySDLog::initSPI(void)
 #define CT_SDC        (CT_SD1|CT_SD2) /* SD */
 #define CT_BLOCK      0x08  /* Block addressing */
 
+/* R1 response flags */
+#define R1_COM_CRC_ERR 0x08  /* Command CRC check failed */
+
+/* Data response tokens */
+#define DR_ACCEPTED    0x05  /* Data accepted */
+#define DR_CRC_ERR     0x0B  /* Data rejected due to a CRC error */
+
+#ifdef TINY_SD_LOGGER_CRC
+/*-----------------------------------------------------------------------*/
+/* Shift one byte into CRC7 (x^7 + x^3 + 1) of command packet            */
+/*-----------------------------------------------------------------------*/
+
+static unsigned char crc7(unsigned char crc, unsigned char d)
+{
+  for (unsigned char i = 0; i < 8; i++, d <<= 1)
+  {
+    crc <<= 1;
+    if ((d ^ crc) & 0x80) crc ^= 0x09;
+  }
+  return crc;
+}
+#endif
+
 /*-----------------------------------------------------------------------*/
 /* Send a command packet to MMC                                          */
 /*-----------------------------------------------------------------------*/
 
+#ifdef TINY_SD_LOGGER_CRC
 unsigned char TinySDLog::sendSDCommand(unsigned char cmd, unsigned long arg)
+{
+  unsigned char res;
+
+  /* Resend the command (together with CMD55 prefix of ACMD<n>) if its packet was corrupted */
+  for (unsigned char retry = TINY_SD_LOGGER_CRC_RETRIES; ; retry--) {
+    res = sendSDPacket(cmd, arg);
+    if ((res & 0x80) || !(res & R1_COM_CRC_ERR) || !retry) return res;
+  }
+}
+
+unsigned char TinySDLog::sendSDPacket(unsigned char cmd, unsigned long arg)
+#else
+unsigned char TinySDLog::sendSDCommand(unsigned char cmd, unsigned long arg)
+#endif
 {
   unsigned char n, res;
 
@@ -90,9 +160,18 @@ unsigned char TinySDLog::sendSDCommand(unsigned char cmd, unsigned long arg)
   sendSPI((unsigned char)(arg >> 16));    /* Argument[23..16] */
   sendSPI((unsigned char)(arg >> 8));     /* Argument[15..8] */
   sendSPI((unsigned char)arg);        /* Argument[7..0] */
+#ifdef TINY_SD_LOGGER_CRC
+  n = crc7(0, cmd);
+  n = crc7(n, (unsigned char)(arg >> 24));
+  n = crc7(n, (unsigned char)(arg >> 16));
+  n = crc7(n, (unsigned char)(arg >> 8));
+  n = crc7(n, (unsigned char)arg);
+  n = (n << 1) | 0x01;  /* CRC7 + Stop */
+#else
   n = 0x01;             /* Dummy CRC + Stop */
   if (cmd == CMD0) n = 0x95;      /* Valid CRC for CMD0(0) */
   if (cmd == CMD8) n = 0x87;      /* Valid CRC for CMD8(0x1AA) */
+#endif
   sendSPI(n);
 
   /* Receive a command response */
@@ -120,7 +199,28 @@ static void dly_100us (void) {
 
 /* Status of Disk Functions */
 
+#ifdef TINY_SD_LOGGER_CRC
+TinySDLog::DRESULT TinySDLog::readSD(
+  unsigned char *buff,   /* Pointer to the read buffer (NULL:Forward to the stream) */
+  unsigned long sector, /* Sector number (LBA) */
+  unsigned int offset,  /* Byte offset to read from (0..511) */
+  unsigned int count    /* Number of bytes to read (ofs + cnt mus be <= 512) */
+)
+{
+  DRESULT res;
+
+  /* Read the sector again if its data packet was corrupted */
+  for (unsigned char attempt = 0; attempt <= TINY_SD_LOGGER_CRC_RETRIES; attempt++) {
+    res = readSDBlock(buff, sector, offset, count);
+    if (res != RES_CRCERR) break;
+  }
+  return res;
+}
+
+TinySDLog::DRESULT TinySDLog::readSDBlock(
+#else
 TinySDLog::DRESULT TinySDLog::readSD(
+#endif
   unsigned char *buff,   /* Pointer to the read buffer (NULL:Forward to the stream) */
   unsigned long sector, /* Sector number (LBA) */
   unsigned int offset,  /* Byte offset to read from (0..511) */
@@ -141,6 +241,9 @@ TinySDLog::DRESULT TinySDLog::readSD(
     } while (rc == 0xFF && --bc);
 
     if (rc == 0xFE) { /* A data packet arrived */
+#ifdef TINY_SD_LOGGER_CRC
+      crc16 = 0;
+#endif
 
       bc = 512 + 2 - offset - count;  /* Number of trailing bytes to skip */
 
@@ -162,6 +265,9 @@ TinySDLog::DRESULT TinySDLog::readSD(
       do receiveSPI(); while (--bc);
 
       res = RES_OK;
+#ifdef TINY_SD_LOGGER_CRC
+      if (crc16) res = RES_CRCERR; /* CRC16 over data followed by its CRC must be zero */
+#endif
     }
   }
 
@@ -201,21 +307,41 @@ TinySDLog::DRESULT TinySDLog::writeSD (
     /* WRITE_SINGLE_BLOCK */
     sendSPI(0xFF); 
     sendSPI(0xFE);   /* Data block header */
+#ifdef TINY_SD_LOGGER_CRC
+    crc16 = 0;
+#endif
     wc = 512;             /* Set byte counter */
     return RES_OK;
   } 
 
   /* Finalize sector write process */
   DRESULT res = RES_ERROR;
+#ifdef TINY_SD_LOGGER_CRC
+  bc = wc;
+  while (bc--) sendSPI(0); /* Fill left bytes with zeros */
+  bc = crc16;
+  sendSPI((unsigned char)(bc >> 8)); /* CRC16 of data block */
+  sendSPI((unsigned char)bc);
+#else
   bc = wc + 2;
   while (bc--) sendSPI(0); /* Fill left bytes and CRC with zeros */
-  if((receiveSPI() & 0x1F) == 0x05) 
+#endif
+  unsigned char rc = receiveSPI() & 0x1F;
+  if(rc == DR_ACCEPTED) 
   { /* Receive data resp and wait for end of write process in timeout of 500ms */
     for (bc = 5000; receiveSPI() != 0xFF && bc; bc--) dly_100us(); /* Wait for ready */
     if(bc) res = RES_OK;
     DESELECT();
     receiveSPI();
   }
+#ifdef TINY_SD_LOGGER_CRC
+  else if(rc == DR_CRC_ERR)
+  { /* Card rejected the data block, sector is left unchanged */
+    res = RES_CRCERR;
+    DESELECT();
+    receiveSPI();
+  }
+#endif
   return res;
 }
 
@@ -256,6 +382,9 @@ unsigned char TinySDLog::initSD(void)
         ty = 0;
     }
   }
+#ifdef TINY_SD_LOGGER_CRC
+  if (ty && sendSDCommand(CMD59, 1) != 0) ty = 0;  /* Enable CRC check of commands and data */
+#endif
   cardType = ty;
   DESELECT();
   receiveSPI();
@@ -396,61 +525,72 @@ static unsigned char logFileInfo[32] =
 
 TinySDLog::ResultCode TinySDLog::updateLogFileInfo ()
 {
-  // prepare sector for writing
-  if(writeSD(0, clust2sect(dirbase) + logFileInfoSector)) return RC_DISK_ERR;
-
   ST_DWORD(logFileInfo + DIR_FileSize, logFileSize);
-  
-  // write file info
-  if (writeSD(logFileInfo, sizeof(logFileInfo))) return RC_DISK_ERR;
 
-  // finalize sector writing
-  if (writeSD(0, 0)) return RC_DISK_ERR;
+  // directory sector is fully regenerated from logFileInfo, so it may be resent if card rejects it
+  for(unsigned char attempt = 0; ; attempt++)
+  {
+    // prepare sector for writing
+    if(writeSD(0, clust2sect(dirbase) + logFileInfoSector)) return RC_DISK_ERR;
+
+    // write file info
+    if (writeSD(logFileInfo, sizeof(logFileInfo))) return RC_DISK_ERR;
 
-  return RC_OK;
+    // finalize sector writing
+    DRESULT res = writeSD(0, 0);
+    if(res == RES_OK) return RC_OK;
+    if(res != RES_CRCERR) return RC_DISK_ERR;
+    if(attempt == TINY_SD_LOGGER_CRC_RETRIES) return RC_CRC_ERR;
+  }
 }
 
-TinySDLog::ResultCode TinySDLog::updateSingleFatSector(unsigned char fatNum)
+// writes FAT sector, where first 'links' records point to the next cluster 
+// and then optional end of cluster chain record follows. 'fatRec' is the first cluster of sector
+TinySDLog::ResultCode TinySDLog::writeFatSector(unsigned long sect, unsigned long fatRec, unsigned char links, bool eoc)
 {
-  unsigned long cluster;
-  unsigned long fatRec;
-
-  cluster = logFileFirstCluster + (logFileSize + 1) / (512 * csize);
-
-  if(((cluster & 0x7F) == 0) && cluster)
+  // FAT sector is fully regenerated from arguments, so it may be resent if card rejects it
+  for(unsigned char attempt = 0; ; attempt++)
   {
-    // need to remove EOC from previous sector
     // prepare sector for writing
-    unsigned long prevCluster = cluster - 0x80;
-    if(writeSD(0, fatbase + sectorsPerFat * fatNum + (prevCluster >> 7))) return RC_DISK_ERR;
+    if(writeSD(0, sect)) return RC_DISK_ERR;
 
-    fatRec = prevCluster & 0xFFFFFF80;
-    for(unsigned char fatRemain = 0; fatRemain < 128; fatRemain++)
+    unsigned long rec = fatRec;
+    for(unsigned char fatRemain = 0; fatRemain < links; fatRemain++)
     {
-      fatRec++;
-      if(writeSD((unsigned char*)&fatRec, sizeof(fatRec))) return RC_DISK_ERR;
+      rec++;
+      if(writeSD((unsigned char*)&rec, sizeof(rec))) return RC_DISK_ERR;
+    }
+
+    if(eoc)
+    {
+      rec = 0x0FFFFFFF; // end of cluster chain
+      if(writeSD((unsigned char*)&rec, sizeof(rec))) return RC_DISK_ERR;
     }
 
     // finalize sector writing
-    if (writeSD(0, 0)) return RC_DISK_ERR;
+    DRESULT res = writeSD(0, 0);
+    if(res == RES_OK) return RC_OK;
+    if(res != RES_CRCERR) return RC_DISK_ERR;
+    if(attempt == TINY_SD_LOGGER_CRC_RETRIES) return RC_CRC_ERR;
   }
-  // prepare sector for writing
-  if(writeSD(0, fatbase + sectorsPerFat * fatNum + (cluster >> 7))) return RC_DISK_ERR;
+}
 
-  fatRec = cluster & 0xFFFFFF80;
-  for(unsigned char fatRemain = 0; fatRemain < (cluster & 0x7F); fatRemain++)
-  {
-    fatRec++;
-    if(writeSD((unsigned char*)&fatRec, sizeof(fatRec))) return RC_DISK_ERR;
-  }
+TinySDLog::ResultCode TinySDLog::updateSingleFatSector(unsigned char fatNum)
+{
+  unsigned long cluster;
+  ResultCode res;
 
-  fatRec = 0x0FFFFFFF; // end of cluster chain
-  if(writeSD((unsigned char*)&fatRec, sizeof(fatRec))) return RC_DISK_ERR;
+  cluster = logFileFirstCluster + (logFileSize + 1) / (512 * csize);
 
-  // finalize sector writing
-  if (writeSD(0, 0)) return RC_DISK_ERR;
+  if(((cluster & 0x7F) == 0) && cluster)
+  {
+    // need to remove EOC from previous sector
+    unsigned long prevCluster = cluster - 0x80;
+    res = writeFatSector(fatbase + sectorsPerFat * fatNum + (prevCluster >> 7), prevCluster & 0xFFFFFF80, 128, false);
+    if(res) return res;
+  }
 
-  return RC_OK;
+  return writeFatSector(fatbase + sectorsPerFat * fatNum + (cluster >> 7), cluster & 0xFFFFFF80, cluster & 0x7F, true);
 }
 
 TinySDLog::ResultCode TinySDLog::updateFatSector()
@@ -491,8 +631,58 @@ TinySDLog::ResultCode TinySDLog::initLogFile()
   return RC_OK;
 }
 
+#ifdef TINY_SD_LOGGER_CRC
+static const char lostSectorMark[] PROGMEM = "\nSECTOR LOST (CRC)";
+
+// replaces data sector rejected by card with a filler: mark, spaces and line feed
+TinySDLog::ResultCode TinySDLog::writeLostSector(unsigned long sect)
+{
+  for(unsigned char attempt = 0; ; attempt++)
+  {
+    // prepare sector for writing
+    if(writeSD(0, sect)) return RC_DISK_ERR;
+
+    for(unsigned short i = 0; i < 512; i++)
+    {
+      unsigned char c = ' ';
+      if(i < sizeof(lostSectorMark) - 1) c = pgm_read_byte(lostSectorMark + i);
+      if(i == 511) c = '\n';
+      if(writeSD(&c, 1)) return RC_DISK_ERR;
+    }
+
+    // finalize sector writing
+    DRESULT res = writeSD(0, 0);
+    if(res == RES_OK) return RC_OK;
+    if(res != RES_CRCERR) return RC_DISK_ERR;
+    if(attempt == TINY_SD_LOGGER_CRC_RETRIES) return RC_CRC_ERR;
+  }
+}
+#endif
+
+// finalizes current data sector of log file and stores file size.
+// Lost data sector is only reported by close(), any other failure is returned
+TinySDLog::ResultCode TinySDLog::finalizeLogSector()
+{
+  DRESULT dres = writeSD(0, 0);
+#ifdef TINY_SD_LOGGER_CRC
+  if(dres == RES_CRCERR)
+  {
+    // data can not be resent (there is no sector buffer), so sector is replaced by filler
+    lostSectors = true;
+    ResultCode res = writeLostSector(database + (logFileFirstCluster - 2) * csize + ((logFileSize - 1) >> 9));
+    if(res) return res;
+    dres = RES_OK;
+  }
+#endif
+  if(dres) return RC_DISK_ERR;
+  return updateLogFileInfo();
+}
+
 TinySDLog::ResultCode TinySDLog::close()
 {
+#ifdef TINY_SD_LOGGER_LEVEL
+  writeLogStats();
+#endif
   char buf = ' ';
   if(logFileSize & 0x1FF)
   {
@@ -502,11 +692,17 @@ TinySDLog::ResultCode TinySDLog::close()
     }
     buf = '\n';
     if (writeSD(&buf, 1)) return RC_DISK_ERR;
-    // finalize sector writing
-    if (writeSD(0, 0)) return RC_DISK_ERR;
     logFileSize = (logFileSize & 0xFFFFFE00) + 0x200;
-    return updateLogFileInfo();
+    ResultCode res = finalizeLogSector();
+    if(res) return res;
+  }
+#ifdef TINY_SD_LOGGER_CRC
+  if(lostSectors)
+  {
+    lostSectors = false;
+    return RC_CRC_ERR;
   }
+#endif
   return RC_OK;
 }
 
@@ -536,9 +732,7 @@ TinySDLog::ResultCode TinySDLog::writeLogFile(const void* bufPtr, unsigned int b
     logFileSize += blockSize;
     if((logFileSize & 0x1FF) == 0)
     {
-      // finalize sector writing
-      if (writeSD(0, 0)) return RC_DISK_ERR;
-      res = updateLogFileInfo();
+      res = finalizeLogSector();
       if(res) return res;
     }
   }
@@ -548,6 +742,13 @@ TinySDLog::ResultCode TinySDLog::writeLogFile(const void* bufPtr, unsigned int b
 
 size_t TinySDLog::write(uint8_t b)
 {
+#ifdef TINY_SD_LOGGER_LEVEL
+  if(hashing)
+  {
+    recordHash = (recordHash << 5) + recordHash + b;
+    return 1;
+  }
+#endif
   return writeLogFile(&b, 1) ? 0 : 1;
 }
 
@@ -581,6 +782,133 @@ bool TinySDLog::writeTimestamp(void)
   return true;
 }
 
+#ifdef TINY_SD_LOGGER_LEVEL
+/***************************************************************************
+****************************************************************************
+                      L E V E L E D   L O G G I N G
+****************************************************************************
+****************************************************************************/
+
+#if TINY_SD_LOGGER_BURST < 1 || TINY_SD_LOGGER_BURST > 65
+#error "TINY_SD_LOGGER_BURST must be in range 1..65"
+#endif
+
+#define TOKENS_PER_RECORD 1000
+#define TOKENS_MAX        (TINY_SD_LOGGER_BURST * TOKENS_PER_RECORD)
+
+static const unsigned char logRates[] PROGMEM = 
+  {TINY_SD_LOGGER_RATE_TRACE, TINY_SD_LOGGER_RATE_DEBUG, TINY_SD_LOGGER_RATE_INFO, 
+   TINY_SD_LOGGER_RATE_WARN, TINY_SD_LOGGER_RATE_ERROR};
+
+static const char logLevelTags[] PROGMEM = "TDIWE";
+
+void TinySDLog::initLogLimits()
+{
+  for(unsigned char i = 0; i <= TINY_SD_LOGGER_LEVEL_ERROR; i++)
+  {
+    tokens[i] = TOKENS_MAX;
+    dropped[i] = 0;
+  }
+  lastRefill = lastReport = millis();
+  lastLevel = 0xFF;
+  repeatCount = 0;
+  hashing = false;
+}
+
+// writes timestamp (if RTC is used) and level letter
+void TinySDLog::writeRecordHeader(unsigned char level)
+{
+  writeTimestamp();
+  write(pgm_read_byte(logLevelTags + level));
+  write(' ');
+}
+
+void TinySDLog::writeRepeatCount()
+{
+  if(repeatCount)
+  {
+    writeRecordHeader(lastLevel);
+    print(F("last message repeated "));
+    print(repeatCount);
+    print(F(" times\n"));
+    repeatCount = 0;
+  }
+}
+
+void TinySDLog::writeLogStats()
+{
+  writeRepeatCount();
+
+  bool hasDropped = false;
+  for(unsigned char i = 0; i <= TINY_SD_LOGGER_LEVEL_ERROR; i++)
+  {
+    if(dropped[i]) hasDropped = true;
+  }
+  if(hasDropped)
+  {
+    writeRecordHeader(TINY_SD_LOGGER_LEVEL_WARN);
+    print(F("dropped records:"));
+    for(unsigned char i = 0; i <= TINY_SD_LOGGER_LEVEL_ERROR; i++)
+    {
+      write(' ');
+      write(pgm_read_byte(logLevelTags + i));
+      print(dropped[i]);
+      dropped[i] = 0;
+    }
+    write('\n');
+  }
+}
+
+// checks rate limit and repeat suppression and writes record header if record is accepted
+bool TinySDLog::beginRecord(unsigned char level)
+{
+  unsigned long now = millis();
+
+  if(level > TINY_SD_LOGGER_LEVEL_ERROR) level = TINY_SD_LOGGER_LEVEL_ERROR;
+
+  // refill rate limit buckets (each token per millisecond equals one record per second)
+  unsigned long elapsed = now - lastRefill;
+  lastRefill = now;
+  if(elapsed > TINY_SD_LOGGER_BURST * 1000UL) elapsed = TINY_SD_LOGGER_BURST * 1000UL;
+  for(unsigned char i = 0; i <= TINY_SD_LOGGER_LEVEL_ERROR; i++)
+  {
+    unsigned long t = tokens[i] + elapsed * pgm_read_byte(logRates + i);
+    tokens[i] = t > TOKENS_MAX ? TOKENS_MAX : t;
+  }
+
+  if(now - lastReport >= TINY_SD_LOGGER_REPORT_PERIOD)
+  {
+    writeLogStats();
+    lastReport = now;
+  }
+
+  // suppress repeat of last written record
+  if(level == lastLevel && recordHash == lastHash)
+  {
+    if(repeatCount != 0xFFFF) repeatCount++;
+    return false;
+  }
+  writeRepeatCount();
+
+  // apply rate limit
+  if(pgm_read_byte(logRates + level))
+  {
+    if(tokens[level] < TOKENS_PER_RECORD)
+    {
+      if(dropped[level] != 0xFFFF) dropped[level]++;
+      return false;
+    }
+    tokens[level] -= TOKENS_PER_RECORD;
+  }
+
+  lastLevel = level;
+  lastHash = recordHash;
+
+  writeRecordHeader(level);
+  return true;
+}
+#endif
+
 TinySDLog::ResultCode TinySDLog::init()
 {
   ResultCode res;
@@ -592,5 +920,8 @@ TinySDLog::ResultCode TinySDLog::init()
     if(res) continue;
     break;
   }
+#ifdef TINY_SD_LOGGER_LEVEL
+  initLogLimits();
+#endif
   return res;
 }
@@ -12,12 +12,77 @@ This code based on Petit FatFs by ChaN.
 // if you are using DS1307 as RTC and want to log time by writeTimestamp call
 #define TINY_SD_LOGGER_RTC
 
+// if you want to protect SPI transfers with CRC (CMD59), uncomment next line
+// CRC16 of data is calculated bit by bit during transfer, CRC7 of commands by a short loop, no lookup tables are used
+//#define TINY_SD_LOGGER_CRC
+
+// number of resend attempts for a command or sector rejected because of CRC error
+#define TINY_SD_LOGGER_CRC_RETRIES 3
+
+// log levels for TINY_SD_LOG_<LEVEL>(log, first, ...) macros (at least one argument after log is required)
+#define TINY_SD_LOGGER_LEVEL_TRACE 0
+#define TINY_SD_LOGGER_LEVEL_DEBUG 1
+#define TINY_SD_LOGGER_LEVEL_INFO  2
+#define TINY_SD_LOGGER_LEVEL_WARN  3
+#define TINY_SD_LOGGER_LEVEL_ERROR 4
+
+// minimal log level compiled in. Records below it compile to nothing (with their arguments and F() strings).
+// uncomment next line to enable leveled logging
+//#define TINY_SD_LOGGER_LEVEL TINY_SD_LOGGER_LEVEL_INFO
+
+// rate limit of each log level in records per second (0 - unlimited)
+#define TINY_SD_LOGGER_RATE_TRACE 2
+#define TINY_SD_LOGGER_RATE_DEBUG 5
+#define TINY_SD_LOGGER_RATE_INFO  10
+#define TINY_SD_LOGGER_RATE_WARN  20
+#define TINY_SD_LOGGER_RATE_ERROR 0
+
+// number of records of each level which may be written in a burst above the rate limit (1..65)
+#define TINY_SD_LOGGER_BURST 20
+
+// period (ms) of writing counters of dropped records and pending "last message repeated N times"
+#define TINY_SD_LOGGER_REPORT_PERIOD 60000
+
 // SD PINS (this is software SPI, may use any pins)
 #define TINY_SD_LOGGER_CS_PIN   9
 #define TINY_SD_LOGGER_MOSI_PIN 8
 #define TINY_SD_LOGGER_MISO_PIN 7
 #define TINY_SD_LOGGER_SCK_PIN  6
 
+#ifdef TINY_SD_LOGGER_LEVEL
+#if TINY_SD_LOGGER_LEVEL <= TINY_SD_LOGGER_LEVEL_TRACE
+#define TINY_SD_LOG_TRACE(log, first, ...) (log).logRecord(TINY_SD_LOGGER_LEVEL_TRACE, first, ##__VA_ARGS__)
+#endif
+#if TINY_SD_LOGGER_LEVEL <= TINY_SD_LOGGER_LEVEL_DEBUG
+#define TINY_SD_LOG_DEBUG(log, first, ...) (log).logRecord(TINY_SD_LOGGER_LEVEL_DEBUG, first, ##__VA_ARGS__)
+#endif
+#if TINY_SD_LOGGER_LEVEL <= TINY_SD_LOGGER_LEVEL_INFO
+#define TINY_SD_LOG_INFO(log, first, ...)  (log).logRecord(TINY_SD_LOGGER_LEVEL_INFO, first, ##__VA_ARGS__)
+#endif
+#if TINY_SD_LOGGER_LEVEL <= TINY_SD_LOGGER_LEVEL_WARN
+#define TINY_SD_LOG_WARN(log, first, ...)  (log).logRecord(TINY_SD_LOGGER_LEVEL_WARN, first, ##__VA_ARGS__)
+#endif
+#if TINY_SD_LOGGER_LEVEL <= TINY_SD_LOGGER_LEVEL_ERROR
+#define TINY_SD_LOG_ERROR(log, first, ...) (log).logRecord(TINY_SD_LOGGER_LEVEL_ERROR, first, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef TINY_SD_LOG_TRACE
+#define TINY_SD_LOG_TRACE(log, first, ...) do {} while (0)
+#endif
+#ifndef TINY_SD_LOG_DEBUG
+#define TINY_SD_LOG_DEBUG(log, first, ...) do {} while (0)
+#endif
+#ifndef TINY_SD_LOG_INFO
+#define TINY_SD_LOG_INFO(log, first, ...)  do {} while (0)
+#endif
+#ifndef TINY_SD_LOG_WARN
+#define TINY_SD_LOG_WARN(log, first, ...)  do {} while (0)
+#endif
+#ifndef TINY_SD_LOG_ERROR
+#define TINY_SD_LOG_ERROR(log, first, ...) do {} while (0)
+#endif
+
 class TinySDLog : public Print 
 {
 public:
@@ -30,13 +95,33 @@ typedef enum
   RC_NOT_ENABLED,
   RC_NO_FILESYSTEM,
   RC_NO_BOOT_RECORD,
-  RC_BAD_FAT_TYPE
+  RC_BAD_FAT_TYPE,
+  RC_CRC_ERR
 } ResultCode;
 
   ResultCode init();
   bool writeTimestamp(void);
   size_t write(uint8_t b);
   ResultCode close();
+
+#ifdef TINY_SD_LOGGER_LEVEL
+  // writes one record (all arguments and line feed) if it passes rate limit and repeat suppression.
+  // Use TINY_SD_LOG_<LEVEL> macros instead of direct call to compile out records below TINY_SD_LOGGER_LEVEL.
+  // Level above TINY_SD_LOGGER_LEVEL_ERROR is treated as TINY_SD_LOGGER_LEVEL_ERROR
+  template<typename... Args> void logRecord(unsigned char level, const Args&... args)
+  {
+    // first pass only calculates hash of record text (see write())
+    hashing = true;
+    recordHash = 5381;
+    printArgs(*this, args...);
+    hashing = false;
+    if(!beginRecord(level)) return;
+    printArgs(*this, args...);
+    write('\n');
+  }
+  // writes pending "last message repeated N times" and counters of dropped records
+  void writeLogStats();
+#endif
   
 private:
   unsigned char csize;         // Number of sectors per cluster
@@ -50,6 +135,10 @@ private:
 
   unsigned char cardType;
   unsigned int wc; /* Sector write counter */
+#ifdef TINY_SD_LOGGER_CRC
+  uint16_t crc16;  /* CRC16 of data block, updated by each SPI transfer */
+  bool lostSectors; /* Data sector was rejected by card since last close() */
+#endif
 
   // SOFTWARE SPI FUNCTIONS
   void sendSPI(unsigned char d);
@@ -63,12 +152,17 @@ private:
     RES_OK = 0,   /* 0: Function succeeded */
     RES_ERROR,    /* 1: Disk error */
     RES_NOTRDY,   /* 2: Not ready */
-    RES_PARERR    /* 3: Invalid parameter */
+    RES_PARERR,   /* 3: Invalid parameter */
+    RES_CRCERR    /* 4: CRC error */
   } DRESULT;
 
   unsigned char initSD(void);
   unsigned char sendSDCommand(unsigned char cmd, unsigned long arg);
   DRESULT readSD(unsigned char *buff, unsigned long sector, unsigned int offset, unsigned int count);
+#ifdef TINY_SD_LOGGER_CRC
+  unsigned char sendSDPacket(unsigned char cmd, unsigned long arg);
+  DRESULT readSDBlock(unsigned char *buff, unsigned long sector, unsigned int offset, unsigned int count);
+#endif
   DRESULT writeSD(const unsigned char *buff, unsigned long sc);
   
   // FAT FUNCTIONS
@@ -76,11 +170,41 @@ private:
   ResultCode checkFilesystem(unsigned char *buf, unsigned long sect);
   ResultCode mount();
   ResultCode updateLogFileInfo();
+  ResultCode writeFatSector(unsigned long sect, unsigned long fatRec, unsigned char links, bool eoc);
   ResultCode updateSingleFatSector(unsigned char fatNum);
   ResultCode updateFatSector();
   ResultCode initLogFile();
+#ifdef TINY_SD_LOGGER_CRC
+  ResultCode writeLostSector(unsigned long sect);
+#endif
+  ResultCode finalizeLogSector();
   ResultCode writeLogFile(const void* bufPtr, unsigned int bufSize);
   void print2digits(int number);
+
+#ifdef TINY_SD_LOGGER_LEVEL
+  // LEVELED LOGGING
+  unsigned int tokens[TINY_SD_LOGGER_LEVEL_ERROR + 1];  // Rate limit buckets (1000 per record)
+  unsigned int dropped[TINY_SD_LOGGER_LEVEL_ERROR + 1]; // Records dropped by rate limit
+  unsigned long lastRefill;    // Time of last refill of rate limit buckets
+  unsigned long lastReport;    // Time of last write of log statistics
+  unsigned long recordHash;    // Hash of current record
+  unsigned long lastHash;      // Hash of last written record
+  bool hashing;                // write() calculates recordHash instead of writing to card
+  unsigned char lastLevel;     // Level of last written record (0xFF - none)
+  unsigned int repeatCount;    // Number of suppressed repeats of last written record
+
+  static void printArgs(Print&) {}
+  template<typename T, typename... Args> static void printArgs(Print& p, const T& arg, const Args&... args)
+  {
+    p.print(arg);
+    printArgs(p, args...);
+  }
+
+  void initLogLimits();
+  void writeRecordHeader(unsigned char level);
+  void writeRepeatCount();
+  bool beginRecord(unsigned char level);
+#endif
 };
  
 #endif
@@ -24,6 +24,9 @@ void setup()
     SDLog.print(i);
     SDLog.print(F("\n"));
   }
+  // leveled records are written only if TINY_SD_LOGGER_LEVEL is enabled in TinySDLogger.h
+  TINY_SD_LOG_INFO(SDLog, F("Leveled record after loop: "), 100);
+  TINY_SD_LOG_DEBUG(SDLog, F("This record is written only with TINY_SD_LOGGER_LEVEL_DEBUG or lower"));
   Serial.print(F("Stop writing loop\nClose TinySDLog..."));
   
   res = SDLog.close();